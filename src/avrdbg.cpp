@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 
 #if _DEBUG
 
@@ -6,7 +7,14 @@
 #include "iopin.h"
 #include "usart.h"
 
-using DebugUsart = Usart<1>;
+// at 230400 baud a byte takes 43us, so we queue the
+// output instead of having printf() wait for each byte
+using DebugUsart = Usart<1, 0, 64>;
+
+ISR(USART1_DRE_vect)
+{
+	DebugUsart::tx_isr();
+}
 
 #ifndef _WIN32
 static int serial_putchar(char c, FILE*)
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <avr/pgmspace.h>
+
+#include "pedals.h"
+
+// The typed payloads of the pedal events, which the handlers get
+// instead of the raw PedalEvent record.
+
+// the button events: the buttons of the device which
+// are down after the event, bit 0 for button 1
+struct ButtonPayload
+{
+	PedalDevice	device;
+	uint8_t		buttons;
+	uint16_t	tick;
+};
+
+// evExpPosition
+struct PositionPayload
+{
+	uint16_t	position;
+	uint16_t	tick;
+};
+
+// init, offline and the message outcomes
+struct DevicePayload
+{
+	PedalDevice	device;
+	uint16_t	tick;
+};
+
+constexpr bool is_button_event(const PedalEventType type)
+{
+	return (type >= evFtswBtn1Down  &&  type <= evFtswDoubleBtn)
+			||  type == evExpBtnDown  ||  type == evExpBtnUp;
+}
+
+template <PedalEventType Type, bool Button = is_button_event(Type)>
+struct event_payload
+{
+	using type = DevicePayload;
+
+	static type make(const PedalEvent& event)
+	{
+		return { event.device, event.tick };
+	}
+};
+
+template <PedalEventType Type>
+struct event_payload<Type, true>
+{
+	using type = ButtonPayload;
+
+	static type make(const PedalEvent& event)
+	{
+		return { event.device, static_cast<uint8_t>(event.value), event.tick };
+	}
+};
+
+template <>
+struct event_payload<evExpPosition, false>
+{
+	using type = PositionPayload;
+
+	static type make(const PedalEvent& event)
+	{
+		return { event.value, event.tick };
+	}
+};
+
+// a handler of the event Type; F is called with the payload of the event
+template <PedalEventType Type, class F>
+struct EventHandler : F
+{
+	static constexpr PedalEventType event = Type;
+
+	EventHandler(const F& f)
+		: F(f)
+	{}
+};
+
+// on<evFtswBtn1Down>([&](const ButtonPayload& p) { ... })
+template <PedalEventType Type, class F>
+EventHandler<Type, F> on(const F& f)
+{
+	return EventHandler<Type, F>(f);
+}
+
+// the indices 0..N-1 as a parameter pack
+template <uint8_t... I>
+struct index_list {};
+
+template <uint8_t N, uint8_t... I>
+struct make_index_list : make_index_list<N - 1, N - 1, I...> {};
+
+template <uint8_t... I>
+struct make_index_list<0, I...>
+{
+	using type = index_list<I...>;
+};
+
+// Calls the handlers of an event through a table in flash with one
+// entry per event type, which is built at compile time. An entry calls all
+// the handlers of its event type inline, and the events without a
+// handler have a null entry, so they cost nothing but the lookup.
+//
+//	EventDispatcher dispatcher(
+//		on<evFtswBtn1Down>([&](const ButtonPayload& p) { ... }),
+//		on<evExpPosition>([&](const PositionPayload& p) { ... }));
+//
+//	dispatcher.dispatch(pedals.get_event(subscriber));
+template <class... Handlers>
+class EventDispatcher : private Handlers...
+{
+private:
+	using Entry = void (*)(EventDispatcher&, const PedalEvent&);
+
+	template <PedalEventType Type>
+	static constexpr bool has_handler()
+	{
+		return ((Handlers::event == Type)  ||  ...);
+	}
+
+	template <PedalEventType Type, class Handler>
+	void call(const typename event_payload<Type>::type& payload)
+	{
+		if constexpr (Handler::event == Type)
+			static_cast<Handler&>(*this)(payload);
+	}
+
+	template <PedalEventType Type>
+	static void call_all(EventDispatcher& dispatcher, const PedalEvent& event)
+	{
+		const typename event_payload<Type>::type payload = event_payload<Type>::make(event);
+
+		(dispatcher.template call<Type, Handlers>(payload), ...);
+	}
+
+	template <PedalEventType Type>
+	static constexpr Entry entry()
+	{
+		if constexpr (has_handler<Type>())
+			return &call_all<Type>;
+		else
+			return nullptr;
+	}
+
+	template <uint8_t... I>
+	struct Table
+	{
+		static constexpr Entry entries[] PROGMEM = { entry<static_cast<PedalEventType>(I)>()... };
+	};
+
+	using EventTable = typename make_index_list<evCount>::type;
+
+	template <uint8_t... I>
+	static Entry lookup(const PedalEventType type, index_list<I...>)
+	{
+		return reinterpret_cast<Entry>(pgm_read_ptr(&Table<I...>::entries[type]));
+	}
+
+public:
+	EventDispatcher(const Handlers&... handlers)
+		: Handlers(handlers)...
+	{}
+
+	// returns false if nobody handles the event
+	bool dispatch(const PedalEvent& event)
+	{
+		if (event.type >= evCount)
+			return false;
+
+		const Entry handle = lookup(event.type, EventTable());
+		if (handle == nullptr)
+			return false;
+
+		handle(*this, event);
+
+		return true;
+	}
+};
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include <avr/interrupt.h>
+
 #include "iopin.h"
 #include "timera.h"
 #include "usart.h"
@@ -9,6 +11,7 @@
 #include "watch.h"
 
 #include "pedals.h"
+#include "dispatch.h"
 
 using led = IoPin<'C', 6>;
 using btn = IoPin<'C', 7>;
@@ -50,6 +53,9 @@ int main()
 {
 	hw_init();
 
+	// the USART buffers are filled and drained by interrupts
+	sei();
+
 	// setup the debug log
 	dbgInit();
 	dprint("\nI live...\n");
@@ -69,105 +75,114 @@ int main()
 
 	uint8_t mode = 0;
 	uint16_t num = 0;
-	while (true)
+
+	// the middle LED shows that buttons 3 and 4 are both down
+	auto show_middle = [&](const ButtonPayload& p)
 	{
-		const PedalEvent event = pedals.get_event();
-		if (event != evNone)
+		if ((p.buttons & 0x0C) == 0x0C)
+			pedals.set_led(ledFtswMiddle);
+		else
+			pedals.clear_led(ledFtswMiddle);
+	};
+
+	EventDispatcher dispatcher(
+		on<evFtswBtn1Down>([&](const ButtonPayload&)
+		{
+			pedals.set_led(ledFtswModeTuner);
+			pedals.set_led(ledExpGreen);
+
+			if (++mode == 4)
+				mode = 1;
+
+			pedals.clear_led(ledFtswMode1);
+			pedals.clear_led(ledFtswMode2);
+			pedals.clear_led(ledFtswMode3);
+
+			if (mode == 1)
+				pedals.set_led(ledFtswMode1);
+			else if (mode == 2)
+				pedals.set_led(ledFtswMode2);
+			else if (mode == 3)
+				pedals.set_led(ledFtswMode3);
+
+			num = 0;
+			pedals.set_ftsw_number(num);
+		}),
+		on<evFtswBtn1Up>([&](const ButtonPayload&)
+		{
+			pedals.clear_led(ledFtswModeTuner);
+			pedals.clear_led(ledExpGreen);
+		}),
+		on<evFtswBtn2Down>([&](const ButtonPayload&)
+		{
+			num += 100;
+			pedals.set_ftsw_number(num);
+			pedals.set_led(ledFtswQA1);
+		}),
+		on<evFtswBtn2Up>([&](const ButtonPayload&)
+		{
+			pedals.clear_led(ledFtswQA1);
+		}),
+		on<evFtswBtn3Down>([&](const ButtonPayload& p)
+		{
+			num += 10;
+			pedals.set_ftsw_number(num);
+			pedals.set_led(ledFtswQA2);
+			pedals.set_led(ledExpRed);
+			show_middle(p);
+		}),
+		on<evFtswBtn3Up>([&](const ButtonPayload& p)
 		{
-			if (pedals.ftsw_btn3  &&  pedals.ftsw_btn4)
-				pedals.set_led(ledFtswMiddle);
-			else
-				pedals.clear_led(ledFtswMiddle);
-
-			if (event == evFtswBtn1Down)
-			{
-				pedals.set_led(ledFtswModeTuner);
-				pedals.set_led(ledExpGreen);
-
-				if (++mode == 4)
-					mode = 1;
-
-				pedals.clear_led(ledFtswMode1);
-				pedals.clear_led(ledFtswMode2);
-				pedals.clear_led(ledFtswMode3);
-
-				if (mode == 1)
-					pedals.set_led(ledFtswMode1);
-				else if (mode == 2)
-					pedals.set_led(ledFtswMode2);
-				else if (mode == 3)
-					pedals.set_led(ledFtswMode3);
-
-				num = 0;
-				pedals.set_ftsw_number(num);
-			}
-			else if (event == evFtswBtn1Up)
-			{
-				pedals.clear_led(ledFtswModeTuner);
-				pedals.clear_led(ledExpGreen);
-			}
-			else if (event == evFtswBtn2Down)
-			{
-				num += 100;
-				pedals.set_ftsw_number(num);
-				pedals.set_led(ledFtswQA1);
-			}
-			else if (event == evFtswBtn2Up)
-			{
-				pedals.clear_led(ledFtswQA1);
-			}
-			else if (event == evFtswBtn3Down)
-			{
-				num += 10;
-				pedals.set_ftsw_number(num);
-				pedals.set_led(ledFtswQA2);
-				pedals.set_led(ledExpRed);
-			}
-			else if (event == evFtswBtn3Up)
-			{
-				pedals.clear_led(ledFtswQA2);
-				pedals.clear_led(ledExpRed);
-			}
-			else if (event == evFtswBtn4Down)
-			{
-				num += 1;
-				pedals.set_ftsw_number(num);
-				pedals.set_led(ledFtswQA3);
-			}
-			else if (event == evFtswBtn4Up)
-			{
-				pedals.clear_led(ledFtswQA3);
-			}
-			else if (event == evExpPosition)
-			{
-				if (!pedals.ftsw_present)
-					dprint("pos %d\n", pedals.exp_position);
-				
-				num = static_cast<uint16_t>(pedals.exp_position >> 3);
-				if (num > 999)
-					num = 999;
-				pedals.set_ftsw_number(num);
-			}
-			else if (event == evExpBtnDown)
-			{
-				pedals.set_led(ledFtswMiddle);
-				pedals.set_led(ledExpRed);
-				pedals.set_led(ledExpGreen);
-			}
-			else if (event == evExpBtnUp)
-			{
-				pedals.clear_led(ledFtswMiddle);
-				pedals.clear_led(ledExpRed);
-				pedals.clear_led(ledExpGreen);
-			}
-			else if (event == evExpInit)
-				dprint("exp online\n");
-			else if (event == evFtswInit)
-				dprint("ftsw online\n");
-			else if (event == evExpOff)
-				dprint("exp offline\n");
-			else if (event == evFtswOff)
-				dprint("ftsw offline\n");
-		}
+			pedals.clear_led(ledFtswQA2);
+			pedals.clear_led(ledExpRed);
+			show_middle(p);
+		}),
+		on<evFtswBtn4Down>([&](const ButtonPayload& p)
+		{
+			num += 1;
+			pedals.set_ftsw_number(num);
+			pedals.set_led(ledFtswQA3);
+			show_middle(p);
+		}),
+		on<evFtswBtn4Up>([&](const ButtonPayload& p)
+		{
+			pedals.clear_led(ledFtswQA3);
+			show_middle(p);
+		}),
+		on<evExpPosition>([&](const PositionPayload& p)
+		{
+			if (!pedals.ftsw_present())
+				dprint("pos %d\n", p.position);
+			
+			num = static_cast<uint16_t>(p.position >> 3);
+			if (num > 999)
+				num = 999;
+			pedals.set_ftsw_number(num);
+		}),
+		on<evExpBtnDown>([&](const ButtonPayload&)
+		{
+			pedals.set_led(ledFtswMiddle);
+			pedals.set_led(ledExpRed);
+			pedals.set_led(ledExpGreen);
+		}),
+		on<evExpBtnUp>([&](const ButtonPayload&)
+		{
+			pedals.clear_led(ledFtswMiddle);
+			pedals.clear_led(ledExpRed);
+			pedals.clear_led(ledExpGreen);
+		}),
+		on<evExpInit>([](const DevicePayload&)		{ dprint("exp online\n"); }),
+		on<evFtswInit>([](const DevicePayload&)		{ dprint("ftsw online\n"); }),
+		on<evExpOff>([](const DevicePayload&)		{ dprint("exp offline\n"); }),
+		on<evFtswOff>([](const DevicePayload&)		{ dprint("ftsw offline\n"); })
+	);
+
+	EventSubscriber app;
+	pedals.subscribe(app, EVENTS_ALL, true);
+
+	while (true)
+	{
+		pedals.update();
+		dispatcher.dispatch(pedals.get_event(app));
 	}
 }
@@ -1,8 +1,10 @@
 #include <stdint.h>
+#include <string.h>
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
-#include <util/delay.h>
+#include <util/atomic.h>
 
 #include "avrdbg.h"
 #include "pedals.h"
@@ -14,8 +16,8 @@ const uint8_t CMD_POS	= 0xFB;
 const uint8_t CMD_BTN	= 0xFC;
 const uint8_t CMD_INIT	= 0xFD;
 
-const uint8_t ID_EXP	= 0x0C;
-const uint8_t ID_FTSW	= 0x08;
+const uint8_t ID_EXP	= pdExp;
+const uint8_t ID_FTSW	= pdFtsw;
 
 const uint8_t ACK		= 0xFD;
 const uint8_t ERROR		= 0xFE;
@@ -28,6 +30,11 @@ const uint8_t LED_EXP	= 0x70;	// the LEDS on the foot switch
 
 const bool SHOW_LEADING_ZEROS = false;
 
+// set this if the pedal bus is wired straight to PB4 (the USART TX pin)
+// with a pull-up, and leave it cleared if TX and RX have separate pins
+// which are joined by the interface circuit
+const bool ONE_WIRE_BUS = false;
+
 enum
 {
 	// number of consecutive NACK-ed messages before we give up on a pedal
@@ -36,6 +43,30 @@ enum
 	// how many milliseconds do we wait from the last reception
 	// until we start refreshing LEDs
 	REFRESH_DELAY = 0,
+
+	// how many milliseconds we allow for a message to go out on the
+	// bus; a 9 byte message takes about 3ms at 31250 baud
+	SEND_TIMEOUT = 5,
+
+	// how many milliseconds we wait for the pedal to ACK a message
+	ACK_TIMEOUT = 2,
+
+	// how many milliseconds the pedals are kept without power on reset;
+	// we start with the time that has always worked, and once the pedals
+	// respond, we try half of the shortest time that worked on the next
+	// reset; if the pedals don't respond to the known-good time either,
+	// we double it until they do
+	POWER_OFF_TIME = 1000,
+	MIN_POWER_OFF_TIME = 50,
+	MAX_POWER_OFF_TIME = 1600,
+
+	// how many milliseconds after power on we wait for an init message;
+	// a pedal has to be done booting by then, or we cut its power again
+	INIT_TIMEOUT = 2000,
+
+	// if the next byte of a message doesn't arrive in this many
+	// milliseconds we drop what we have and wait for a command byte
+	BYTE_TIMEOUT = 2,
 };
 
 // these are LED values representing numbers
@@ -53,24 +84,240 @@ static const uint8_t digit_segments[10] PROGMEM =
 	0x17 | 0x80,	// 9
 };
 
-bool Pedals::consume(const uint8_t byte)
+// the selectors of the LED groups in the order of Pedals::LedGroup
+static const uint8_t led_group_selectors[] PROGMEM =
+{
+	LED_DISP2,
+	LED_DISP1,
+	LED_DISP0,
+	LED_FTSW,
+	LED_EXP,
+};
+
+ISR(USART3_RXC_vect)
+{
+	Pedals::rx_isr();
+}
+
+ISR(USART3_DRE_vect)
+{
+	Pedals::tx_isr();
+}
+
+void Pedals::rx_isr()
+{
+	uint8_t byte, errors;
+	if (!rx_read(byte, errors))
+	{
+		// the echo of an ACK which was sent before our message
+		if (isr_echo_skip)
+		{
+			isr_echo_skip--;
+			return;
+		}
+
+		if (isr_abort_left)
+		{
+			// the bytes which were in the USART when we stopped our
+			// message are still going out; what comes back is their
+			// echo, unless it's a byte of the pedal which talks now
+			isr_abort_left--;
+
+			const uint8_t pos = isr_abort_pos++;
+			if (pos < sizeof(isr_echo)  &&  byte == isr_sent[pos]  &&  !errors)
+				return;
+
+			// the byte is the pedal's, so it goes to the parser
+		}
+		else if (isr_echo_len < isr_echo_cap  &&  (byte & 0x80)  &&  (isr_echo_len != 0  ||  byte != CMD_LED))
+		{
+			// only the first byte of our message is a command byte, so another
+			// one means a pedal has started to talk; its input wins, we stop
+			// our message, and it's sent again later
+			abort_tx();
+			isr_tx_aborted = true;
+			isr_echo_cap = isr_echo_len;
+
+			// this byte took the place of the echo at isr_echo_len
+			isr_abort_left = echo_pending;
+			isr_abort_pos = isr_echo_len + 1;
+
+			// the byte is the pedal's, so it goes to the parser
+		}
+		else
+		{
+			// a bad echo ends the capture, so the message fails
+			if (errors)
+			{
+				isr_echo_cap = isr_echo_len;
+			}
+			else if (isr_echo_len < isr_echo_cap)
+			{
+				isr_echo[isr_echo_len] = byte;
+				isr_echo_len = isr_echo_len + 1;
+
+				if (isr_echo_len == sizeof(isr_echo))
+				{
+					bool same = true;
+					for (uint8_t c = 0; c < sizeof(isr_echo); c++)
+						same = same  &&  isr_echo[c] == isr_sent[c];
+
+					isr_await_reply = same;
+				}
+			}
+
+			return;
+		}
+	}
+
+	// forget about a message that was cut off, and tell the main
+	// loop with rxTag3, because it may read the bytes from before
+	// and after the gap in the same batch
+	const uint16_t now = Watch::cnt();
+	uint8_t tags = 0;
+	if (static_cast<uint16_t>(now - isr_last_rx) >= Watch::ms2ticks(BYTE_TIMEOUT))
+	{
+		isr_expected = isr_received = 0;
+		tags = rxTag3;
+	}
+
+	isr_last_rx = now;
+
+	// the reply to our message; ACK has the value of CMD_INIT,
+	// so it must not start a message here or in the main loop
+	if (isr_await_reply  &&  (byte == ACK  ||  byte == ERROR))
+	{
+		isr_await_reply = false;
+		isr_expected = isr_received = 0;
+
+		tags |= rxTag2;
+		if (isr_send_gen)
+			tags |= rxTag4;
+
+		rx_store(byte, errors | tags);
+
+		return;
+	}
+
+	bool msg_end = false;
+
+	if (byte & 0x80)
+	{
+		isr_expected = message_length(byte);
+		isr_received = 1;
+		isr_checksum = 0;
+		isr_bad = errors != 0;
+	}
+	else if (isr_expected > isr_received)
+	{
+		isr_checksum ^= byte;
+		if (errors)
+			isr_bad = true;
+
+		if (++isr_received == isr_expected)
+		{
+			// there's no room for the checksum byte, so the main
+			// loop won't see the message, and the pedal has to resend
+			if (rx_buff.full())
+				isr_bad = true;
+
+			// the checksum is the last byte, so the XOR
+			// of the whole payload is 0 if all is well
+			const uint8_t reply = isr_checksum == 0  &&  !isr_bad ? ACK : ERROR;
+			if (send(&reply, 1))
+			{
+				ack_since = Watch::cnt();
+				ack_queued = true;
+			}
+
+			isr_expected = isr_received = 0;
+			msg_end = true;
+		}
+	}
+	else
+	{
+		isr_expected = isr_received = 0;
+	}
+
+	// the tick of the checksum byte goes with it to the main loop,
+	// if there's room for it; a byte we drop makes the pedal resend
+	const bool tagged = msg_end  &&  !isr_msg_ticks.full();
+	if (tagged)
+		tags |= rxTag;
+
+	if (!rx_store(byte, errors | tags))
+		isr_bad = true;
+	else if (tagged)
+		isr_msg_ticks.push(now);
+}
+
+void Pedals::tx_isr()
+{
+	// frame bytes can be queued ahead of the ACK, so we wait for the
+	// reply byte itself; no byte of our frames is an ACK or ERROR
+	const uint8_t next = tx_buff.peek();
+	if (ack_queued  &&  (next == ACK  ||  next == ERROR))
+	{
+		const uint16_t turnaround = Watch::cnt() - ack_since;
+
+		ack_stats.cnt++;
+		ack_stats.last = turnaround;
+		if (turnaround > ack_stats.max)
+			ack_stats.max = turnaround;
+
+		ack_queued = false;
+	}
+
+	Usart::tx_isr();
+}
+
+Pedals::AckStats Pedals::get_ack_stats()
+{
+	AckStats ret_val;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		ret_val = ack_stats;
+
+	return ret_val;
+}
+
+uint16_t Pedals::last_rx()
+{
+	uint16_t ret_val;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		ret_val = isr_last_rx;
+
+	return ret_val;
+}
+
+uint8_t Pedals::message_length(const uint8_t cmd)
+{
+	switch (cmd)
+	{
+	case CMD_INIT:	return 4;
+	case CMD_BTN:	return 5;
+	case CMD_POS:	return 6;
+	case CMD_DBTN:	return 7;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+bool Pedals::consume(const uint8_t byte, const uint8_t errors)
 {
 	// is this a command byte?
 	if (byte & 0x80)
 	{
 		receive[0] = byte;
 		received = 1;
+		expected = message_length(byte);
+		rx_bad = false;
 
-		switch (byte)
+		if (expected == 0)
 		{
-		case CMD_INIT:	expected = 4;	break;
-		case CMD_BTN:	expected = 5;	break;
-		case CMD_POS:	expected = 6;	break;
-		case CMD_DBTN:	expected = 7;	break;
-		default:
 			dprint("nxpd cmd %02X\n", byte);
-			expected = received = 0;
-			break;
+			received = 0;
 		}
 	}
 	else if (expected > received)
@@ -83,55 +330,350 @@ bool Pedals::consume(const uint8_t byte)
 		received = expected = 0;
 	}
 
+	// the whole message is dropped once it's complete
+	if (errors  &&  received > 0)
+	{
+		dprint("rx err %02X\n", errors);
+		rx_bad = true;
+	}
+
 	return expected == received  &&  received > 0;
 }
 
-PedalEvent Pedals::get_event()
+void Pedals::update()
 {
-	uint8_t byte = 0;
-	while (read_byte(byte)  &&  consume(byte))
-		parse_message();
+	// don't miss a lap of the Watch while nobody reads events
+	watch_lap(Watch::now());
+
+	// are we in the middle of a power cycle?
+	if (power_state == psOff)
+	{
+		if (!Watch::ms_passed_since(power_off_time, power_started))
+			return;
+
+		power_on();
+	}
+	else if (power_state == psWaitInit  &&  Watch::ms_passed_since(INIT_TIMEOUT, power_started))
+	{
+		if (power_off_time < power_off_good)
+		{
+			// the shorter power off didn't work, so we go back to
+			// the one which did, and never try this short again
+			power_off_bad = power_off_time;
+			power_off_time = power_off_good;
+
+			dprint("no init, power off %dms\n", power_off_time);
+
+			power_off();
+
+			return;
+		}
+
+		if (power_off_time < MAX_POWER_OFF_TIME)
+		{
+			// the power off was too short for the pedals
+			// to notice, so we try again with a longer one
+			power_off_time *= 2;
+			if (power_off_time > MAX_POWER_OFF_TIME)
+				power_off_time = MAX_POWER_OFF_TIME;
+
+			dprint("no init, power off %dms\n", power_off_time);
+
+			power_off();
+
+			return;
+		}
+
+		// there are probably no pedals connected, so we stop
+		// power cycling and wait for one to be plugged in
+		power_state = psOn;
+	}
+
+	// take everything the RX interrupt has buffered in one batch
+	read_all([this](const uint8_t byte, uint8_t errors)
+	{
+		// the byte came after a gap, so the message we have is cut off
+		if (errors & rxTag3)
+		{
+			if (received != 0)
+			{
+				dprint("rx timeout %02X\n", receive[0]);
+				received = expected = 0;
+				rx_timeouts++;
+			}
+
+			errors &= ~rxTag3;
+		}
+
+		if (errors & rxTag)
+		{
+			if (!isr_msg_ticks.safe_pop(msg_tick))
+				msg_tick = Watch::now();
+			errors &= ~rxTag;
+		}
+
+		// the interrupt has seen our whole message on the bus, so this
+		// is the reply to it, even if we haven't checked the echo yet
+		if (errors & rxTag2)
+		{
+			const bool gen = (errors & rxTag4) != 0;
+			errors &= ~(rxTag2 | rxTag4);
+
+			if ((send_state == ssSending  ||  send_state == ssAwaitAck)  &&  gen == isr_send_gen)
+			{
+				const bool acked = byte == ACK  &&  errors == 0;
+				if (!acked)
+					dprint("bad checksum %02x\n", byte);
+
+				message_done(acked);
+			}
+		}
+		else if (consume(byte, errors))
+		{
+			parse_message();
+		}
+	});
+
+	// the RX buffer is empty, so if the rest of the message
+	// is late, it was cut off and we resync on the next command
+	if (received != 0  &&  Watch::ms_passed_since(BYTE_TIMEOUT, last_rx()))
+	{
+		dprint("rx timeout %02X\n", receive[0]);
+		received = expected = 0;
+		rx_timeouts++;
+	}
+
+	advance_message();
+
+	plan_frames();
 
-	if (received == 0			// no active reception
-		&&  events.empty()		// no unhandled events
+	if (send_state == ssIdle	// no message in flight
+		&&  received == 0		// no active reception
+		&&  !events_pending()	// the event handlers are done
 		&&  (REFRESH_DELAY == 0  ||  Watch::ms_passed_since(REFRESH_DELAY, last_reception)))
 	{
-		refresh_ftsw_display();
-		refresh_ftsw_leds();
-		refresh_exp_leds();
+		// one message at a time
+		send_next_frame();
 	}
+}
+
+bool Pedals::subscribe(EventSubscriber& sub, const uint32_t mask, const bool holds_refresh)
+{
+	if (subscriber_cnt == MAX_SUBSCRIBERS)
+		return false;
+
+	sub.mask = mask;
+	sub.holds_refresh = holds_refresh;
+	events.join(sub.events_cur);
+	outcomes.join(sub.outcomes_cur);
+	sub.position_seq = position_seq;
+
+	subscribers[subscriber_cnt++] = &sub;
+
+	return true;
+}
+
+PedalEvent Pedals::get_event(EventSubscriber& sub)
+{
+	PedalEvent event;
+
+	if (read_queue(event_stats, events, sub.events_cur, sub.mask, event))
+		return event;
+
+	if (read_queue(outcome_stats, outcomes, sub.outcomes_cur, sub.mask, event))
+		return event;
+
+	if (sub.position_seq != position_seq)
+	{
+		sub.position_seq = position_seq;
+
+		if (sub.mask & event_mask(evExpPosition))
+		{
+			count_dwell(position_stats, pending_pos);
+			return pending_pos.event;
+		}
+	}
+
+	return {};
+}
+
+// skips the events the subscriber doesn't want, and
+// returns false if there is nothing left for it
+template <uint8_t Capacity>
+bool Pedals::read_queue(QueueStats& stats, const bcast_ring<QueuedEvent, Capacity>& queue,
+						bcast_cursor& cur, const uint32_t mask, PedalEvent& event)
+{
+	QueuedEvent queued;
+
+	bool found = false;
+	while (!found  &&  queue.read(cur, queued))
+		found = (mask & event_mask(queued.event.type)) != 0;
+
+	if (found)
+	{
+		count_dwell(stats, queued);
+		event = queued.event;
+	}
+
+	return found;
+}
+
+// the subscriber furthest behind sets the peak, and the push
+// is a drop if it has overwritten an event a subscriber hasn't read
+template <uint8_t Capacity>
+void Pedals::count_push(QueueStats& stats, const bcast_ring<QueuedEvent, Capacity>& queue,
+						bcast_cursor EventSubscriber::* cur)
+{
+	stats.pushes++;
+
+	bool dropped = false;
+	for (uint8_t c = 0; c < subscriber_cnt; c++)
+	{
+		const uint16_t behind = queue.behind(subscribers[c]->*cur);
+		if (behind > stats.peak)
+			stats.peak = behind;
+
+		if (behind > Capacity)
+			dropped = true;
+	}
+
+	if (dropped)
+		stats.drops++;
+}
+
+// the lap of the Watch a tick from the last Watch::max_ms() is in;
+// this has to be called more often than the Watch wraps around
+uint16_t Pedals::watch_lap(const uint16_t tick)
+{
+	const uint16_t now = Watch::now();
+	if (now < watch_last)
+		watch_laps++;
+
+	watch_last = now;
+
+	// the tick is from before the Watch wrapped around
+	return tick > now ? watch_laps - 1 : watch_laps;
+}
+
+void Pedals::count_dwell(QueueStats& stats, const QueuedEvent& queued)
+{
+	const uint16_t now = Watch::now();
+	const uint16_t laps = watch_lap(now) - queued.lap;
 
-	if (events.empty())
-		return evNone;
+	// a lap or more is longer than the Watch can measure
+	uint16_t dwell = now - queued.event.tick;
+	if (laps > 1  ||  (laps == 1  &&  now >= queued.event.tick))
+		dwell = 0xffff;
 
-	return events.pop();
+	stats.dwell_last = dwell;
+	if (dwell > stats.dwell_max)
+		stats.dwell_max = dwell;
+}
+
+bool Pedals::events_pending() const
+{
+	for (uint8_t c = 0; c < subscriber_cnt; c++)
+	{
+		const EventSubscriber& sub = *subscribers[c];
+		if (!sub.holds_refresh)
+			continue;
+
+		auto wanted = [&sub](const QueuedEvent& queued)
+		{
+			return (sub.mask & event_mask(queued.event.type)) != 0;
+		};
+
+		if (events.pending(sub.events_cur, wanted)
+				||  outcomes.pending(sub.outcomes_cur, wanted)
+				||  (sub.position_seq != position_seq  &&  (sub.mask & event_mask(evExpPosition))))
+			return true;
+	}
+
+	return false;
 }
 
 void Pedals::reset()
 {
-	// TODO: this function should not block
+	// try a shorter power off than the shortest that has worked so
+	// far, unless it's one that has already failed
+	if (power_off_good == 0)
+	{
+		power_off_time = POWER_OFF_TIME;
+	}
+	else
+	{
+		const uint16_t shorter = power_off_good / 2;
+		power_off_time = shorter > power_off_bad  &&  shorter >= MIN_POWER_OFF_TIME ? shorter : power_off_good;
+	}
+
+	power_off();
+}
 
+void Pedals::power_off()
+{
 	enable(false, false);	// disable RX and TX
 
+	// the TX line powers the pedals, so we pull it low to turn them off
 	IoPin<'B', 4>::dir_out();	// TX is out
 	IoPin<'B', 4>::clear();		// lo
 
-	_delay_ms(1000);
+	clear();
 
+	// update() turns the pedals back on when the time is up
+	power_started = Watch::now();
+	power_state = psOff;
+}
+
+void Pedals::power_on()
+{
 	IoPin<'B', 4>::dir_out();	// TX is out
 	IoPin<'B', 5>::dir_in();	// RX is in
 
+	if constexpr (ONE_WIRE_BUS)
+		IoPin<'B', 4>::pullup();	// TX is open-drain and RX
+
+	// forget what the interrupts were in the middle of when the
+	// bus went down; RX is off, so they are not running now
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		isr_msg_ticks.clear();
+		isr_received = isr_expected = 0;
+		isr_checksum = 0;
+		isr_bad = false;
+		isr_echo_len = isr_echo_cap = isr_echo_skip = 0;
+		isr_abort_left = 0;
+		isr_tx_aborted = false;
+		isr_await_reply = false;
+		ack_queued = false;
+	}
+
 	set_baud(31250);
+	set_half_duplex(ONE_WIRE_BUS);
 	enable(true, true);		// enable RX and TX
 
-	clear();
+	// the pedals have to say hello with an init message now
+	power_started = Watch::now();
+	power_state = psWaitInit;
 }
 
 void Pedals::clear()
 {
-	events.clear();
+	// the subscribers skip the events we have so far
+	for (uint8_t c = 0; c < subscriber_cnt; c++)
+	{
+		EventSubscriber& sub = *subscribers[c];
+
+		events.join(sub.events_cur);
+		outcomes.join(sub.outcomes_cur);
+		sub.position_seq = position_seq;
+	}
 
 	received = expected = 0;
+	send_state = ssIdle;
+
+	out_queue.clear();
+	out_free = (1 << OUT_FRAMES) - 1;
+	leds_queued = 0;
 
 	clear_ftsw();
 	clear_exp();
@@ -140,46 +682,101 @@ void Pedals::clear()
 void Pedals::clear_ftsw()
 {
 	ftsw_error_cnt = 0;
-	ftsw_present = false;
 
-	// these force a refresh of LEDs
-	ftsw_number = FTSW_NUM_UNKNOWN;
-	ftsw_leds = static_cast<uint8_t>(new_ftsw_leds + 1);
+	// this forces a refresh of the LEDs
+	leds_known &= ~FTSW_GROUPS;
 
-	ftsw_btn1 = ftsw_btn2 = ftsw_btn3 = ftsw_btn4 = false;
+	state.flags &= ~sfFtswPresent;
+	state.ftsw_buttons = 0;
+	state.seq++;
 }
 
 void Pedals::clear_exp()
 {
 	exp_error_cnt = 0;
-	exp_present = false;
 
-	// these force a refresh of LEDs
-	exp_leds = static_cast<uint8_t>(new_exp_leds + 1);
+	// this forces a refresh of the LEDs
+	leds_known &= ~EXP_GROUPS;
+
+	state.flags &= ~(sfExpPresent | sfExpBtn);
+	state.exp_position = 0;
+	state.seq++;
+}
+
+PedalState Pedals::snapshot() const
+{
+	PedalState ret_val;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		ret_val = state;
 
-	exp_btn = false;
-	exp_position = 0;
+	return ret_val;
 }
 
 void Pedals::set_led(const PedalLED led)
 {
 	// expression or foot switch leds?
 	if (led > 7)
-		new_exp_leds |= (1 << (led - 8));
+		leds_wanted[lgExpLeds] |= (1 << (led - 8));
 	else
-		new_ftsw_leds |= (1 << led);
+		leds_wanted[lgFtswLeds] |= (1 << led);
 }
 
 void Pedals::clear_led(const PedalLED led)
 {
 	// expression or foot switch leds?
 	if (led > 7)
-		new_exp_leds &= ~(1 << (led - 8));
+		leds_wanted[lgExpLeds] &= ~(1 << (led - 8));
 	else
-		new_ftsw_leds &= ~(1 << led);
+		leds_wanted[lgFtswLeds] &= ~(1 << led);
+}
+
+void Pedals::set_ftsw_number(uint16_t num)
+{
+	// we can only show numbers from 0 to 999
+	// on a 3 digit LED display
+	while (num > 999)
+		num -= 1000;
+
+	const uint8_t d0 = static_cast<uint8_t>(num % 10);
+	uint8_t d2 = static_cast<uint8_t>(num / 10);
+	const uint8_t d1 = static_cast<uint8_t>(d2 % 10);
+	d2 /= 10;
+
+	set_ftsw_digit(0, SHOW_LEADING_ZEROS  ||  d2 ? pgm_read_byte(&digit_segments[d2]) : 0);
+	set_ftsw_digit(1, SHOW_LEADING_ZEROS  ||  d1  ||  d2 ? pgm_read_byte(&digit_segments[d1]) : 0);
+	set_ftsw_digit(2, pgm_read_byte(&digit_segments[d0]));
+}
+
+void Pedals::clear_ftsw_number()
+{
+	for (uint8_t d = 0; d < 3; d++)
+		set_ftsw_digit(d, 0);
+}
+
+void Pedals::set_ftsw_digit(const uint8_t digit, const uint8_t segments)
+{
+	if (digit < 3)
+		leds_wanted[lgFtswDisp2 + digit] = segments;
 }
 
-PedalEvent ftsw_btn_change(const uint8_t* pchange)
+uint8_t Pedals::get_ftsw_digit(const uint8_t digit) const
+{
+	return digit < 3 ? leds_wanted[lgFtswDisp2 + digit] : 0;
+}
+
+uint8_t Pedals::ftsw_dirty_digits() const
+{
+	uint8_t ret_val = 0;
+	for (uint8_t d = 0; d < 3; d++)
+	{
+		if (led_group_dirty(lgFtswDisp2 + d))
+			ret_val |= 1 << d;
+	}
+
+	return ret_val;
+}
+
+PedalEventType ftsw_btn_change(const uint8_t* pchange)
 {
 	const uint16_t change_code = *reinterpret_cast<const uint16_t*>(pchange);
 
@@ -202,61 +799,127 @@ PedalEvent ftsw_btn_change(const uint8_t* pchange)
 	return evNone;
 }
 
-void Pedals::update_button_state(const PedalEvent event)
+void Pedals::update_button_state(const PedalEventType type)
 {
-	switch (event)
+	switch (type)
 	{
-	case evExpBtnDown:		exp_btn = true;				break;
-	case evExpBtnUp:		exp_btn = false;			break;
-	case evFtswBtn1Down:	ftsw_btn1 = true;			break;
-	case evFtswBtn1Up:		ftsw_btn1 = false;			break;
-	case evFtswBtn2Down:	ftsw_btn2 = true;			break;
-	case evFtswBtn2Up:		ftsw_btn2 = false;			break;
-	case evFtswBtn3Down:	ftsw_btn3 = true;			break;
-	case evFtswBtn3Up:		ftsw_btn3 = false;			break;
-	case evFtswBtn4Down:	ftsw_btn4 = true;			break;
-	case evFtswBtn4Up:		ftsw_btn4 = false;			break;
+	case evExpBtnDown:		state.flags |= sfExpBtn;		break;
+	case evExpBtnUp:		state.flags &= ~sfExpBtn;		break;
+	case evFtswBtn1Down:	state.ftsw_buttons |= 0x01;		break;
+	case evFtswBtn1Up:		state.ftsw_buttons &= ~0x01;	break;
+	case evFtswBtn2Down:	state.ftsw_buttons |= 0x02;		break;
+	case evFtswBtn2Up:		state.ftsw_buttons &= ~0x02;	break;
+	case evFtswBtn3Down:	state.ftsw_buttons |= 0x04;		break;
+	case evFtswBtn3Up:		state.ftsw_buttons &= ~0x04;	break;
+	case evFtswBtn4Down:	state.ftsw_buttons |= 0x08;		break;
+	case evFtswBtn4Up:		state.ftsw_buttons &= ~0x08;	break;
 	default:
-		break;
+		return;
+	}
+
+	state.seq++;
+}
+
+void Pedals::push_event(const PedalEventType type, const PedalDevice device, const uint16_t value, const uint16_t tick)
+{
+	if (type == evExpPosition)
+	{
+		// a subscriber which wants positions hasn't read the last one,
+		// so it's overwritten; the peak is the most positions in a row
+		// a subscriber has missed, plus the one it reads in the end
+		bool unread = false;
+		for (uint8_t c = 0; c < subscriber_cnt; c++)
+		{
+			if (subscribers[c]->position_seq != position_seq
+					&&  (subscribers[c]->mask & event_mask(evExpPosition)))
+			{
+				unread = true;
+				break;
+			}
+		}
+
+		if (unread)
+		{
+			position_stats.drops++;
+			pos_unread++;
+		}
+		else
+		{
+			pos_unread = 1;
+		}
+
+		if (pos_unread > position_stats.peak)
+			position_stats.peak = pos_unread;
+
+		pending_pos = { {type, device, value, tick}, watch_lap(tick) };
+		position_seq++;
+
+		position_stats.pushes++;
+	}
+	else if (type == evMsgAcked  ||  type == evMsgFailed)
+	{
+		outcomes.push({ {type, device, value, tick}, watch_lap(tick) });
+		count_push(outcome_stats, outcomes, &EventSubscriber::outcomes_cur);
+	}
+	else
+	{
+		events.push({ {type, device, value, tick}, watch_lap(tick) });
+		count_push(event_stats, events, &EventSubscriber::events_cur);
 	}
 }
 
 void Pedals::parse_message()
 {
-	// checksum
+	// checksum; the RX interrupt has already confirmed
+	// the message to the sender, so here we only
+	// drop it if it's bad and wait for it to be resent
 	uint8_t cs = 0;
 	for (uint8_t c = 1; c < received; c++)
 		cs ^= receive[c];
 
-	// confirm to the sender
-	send(cs == 0 ? ACK : ERROR);
-
 	expected = received = 0;
 
+	if (cs != 0  ||  rx_bad)
+	{
+		dprint("bad msg %02X\n", receive[0]);
+		rx_bad_msgs++;
+		return;
+	}
+
 	if constexpr(REFRESH_DELAY != 0)
-		last_reception = Watch::cnt();
+		last_reception = Watch::now();
 
-	PedalEvent event = evNone;
+	PedalEventType event = evNone;
+	uint16_t value = 0;
 
 	if (receive[0] == CMD_INIT)
 	{
+		// the power cycle worked, so we remember how long it was
+		if (power_state == psWaitInit)
+		{
+			power_off_good = power_off_time;
+			power_state = psOn;
+		}
+
 		if (receive[1] == ID_FTSW)
 		{
 			event = evFtswInit;
 			clear_ftsw();
-			ftsw_present = true;
+			state.flags |= sfFtswPresent;
 		}
 		else if (receive[1] == ID_EXP)
 		{
 			event = evExpInit;
 			clear_exp();
-			exp_present = true;
+			state.flags |= sfExpPresent;
 		}
 	}
 	else if (receive[0] == CMD_BTN)
 	{
 		event = ftsw_btn_change(receive + 2);
 		update_button_state(event);
+
+		value = receive[1] == ID_EXP ? state.exp_btn() : state.ftsw_buttons;
 	}
 	else if (receive[0] == CMD_DBTN)
 	{
@@ -267,103 +930,169 @@ void Pedals::parse_message()
 		event = evExpPosition;
 
 		// get the 14 bit position of the rocker
-		exp_position = receive[3];
-		exp_position <<= 7;
-		exp_position |= receive[4];
+		value = receive[3];
+		value <<= 7;
+		value |= receive[4];
 
 		// update the range of the rocker (poor man's calibration)
-		if (exp_position < min_pos) min_pos = exp_position;
-		if (exp_position > max_pos) max_pos = exp_position;
+		if (value < min_pos) min_pos = value;
+		if (value > max_pos) max_pos = value;
 
 		// subtract the minimum from the position
-		exp_position -= min_pos;
+		value -= min_pos;
+
+		state.exp_position = value;
+		state.seq++;
 	}
 
 	if (event != evNone)
 	{
-		events.safe_push(event);
+		const PedalDevice device = static_cast<PedalDevice>(receive[1]);
 
 		if (event == evFtswDoubleBtn)
 		{
-			const PedalEvent first = ftsw_btn_change(receive + 2);
-			const PedalEvent second = ftsw_btn_change(receive + 4);
+			const PedalEventType first = ftsw_btn_change(receive + 2);
+			const PedalEventType second = ftsw_btn_change(receive + 4);
 
 			update_button_state(first);
 			update_button_state(second);
 
-			events.safe_push(first);
-			events.safe_push(second);
+			push_event(event, device, state.ftsw_buttons, msg_tick);
+			push_event(first, device, state.ftsw_buttons, msg_tick);
+			push_event(second, device, state.ftsw_buttons, msg_tick);
+		}
+		else
+		{
+			push_event(event, device, value, msg_tick);
 		}
 	}
 }
 
-bool Pedals::send(const uint8_t b)
+void Pedals::send_message(const uint8_t groups)
 {
-	// send the byte
-	send_byte(b);
-
-	// wait for the byte to appear on RX because
-	// these are connected on the same bus
-	const uint16_t started = Watch::cnt();
-	while (!Watch::ms_passed_since(1, started))
+	uint8_t checksum = 0;
+	for (uint8_t c = 1; c < sizeof(send_buff) - 1; c++)
+		checksum ^= send_buff[c];
+
+	send_buff[sizeof(send_buff) - 1] = checksum;
+
+	// queue the whole message at once, so the interrupt can send it
+	// back-to-back at the speed of the wire; the RX interrupt collects
+	// the echo for us, and it must not queue an ACK between counting
+	// the bytes ahead of the message and queuing it
+	bool queued = false;
+	while (!queued)
 	{
-		uint8_t d = 0;
-		if (read_byte(d))
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 		{
-			if (b != d)
-				dprint("send failed:%02X d:%02X\n", b, d);
-
-			return b == d;
+			const uint8_t ahead = echo_pending + tx_buff.size();
+			if (send(send_buff, sizeof(send_buff)))
+			{
+				isr_echo_len = 0;
+				isr_echo_cap = sizeof(send_buff);
+				isr_echo_skip = ahead;
+				isr_sent = send_buff;
+				isr_abort_left = 0;
+				isr_tx_aborted = false;
+				isr_await_reply = false;
+				isr_send_gen = !isr_send_gen;
+
+				queued = true;
+			}
 		}
 	}
 
-	dprint("send timeout\n");
-
-	return true;
+	send_groups = groups;
+	send_started = Watch::now();
+	send_state = ssSending;
 }
 
-bool Pedals::send_message()
+void Pedals::advance_message()
 {
-	// send the message
-	uint8_t checksum = send_buff[0];
-	for (const uint8_t b : send_buff)
+	if (send_state == ssSending)
 	{
-		if (!send(b))
-			return false;
+		// a pedal's message is coming in, and the groups we
+		// haven't got an ACK for are still dirty, so this is
+		// not an error of the pedal, just a retry later
+		if (isr_tx_aborted)
+		{
+			dprint("send preempted\n");
 
-		checksum ^= b;
-	}
+			isr_tx_aborted = false;
+			tx_preempted++;
+			send_state = ssIdle;
 
-	send(checksum);
+			return;
+		}
 
-	// wait for ACK
-	const uint16_t started = Watch::cnt();
-	uint8_t ack = 0;
-	bool byte_read = false;
-	while (!Watch::ms_passed_since(2, started))
-	{
-		if (read_byte(ack))
+		// wait for the message to make it to the bus
+		if (tx_busy())
 		{
-			if (ack == ACK)
+			if (!Watch::ms_passed_since(SEND_TIMEOUT, send_started))
+				return;
+
+			dprint("send timeout\n");
+			flush_echo();
+		}
+
+		// check if the bus has seen what we sent
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			isr_echo_cap = 0;
+
+		for (uint8_t c = 0; c < sizeof(send_buff); c++)
+		{
+			if (c >= isr_echo_len  ||  isr_echo[c] != send_buff[c])
 			{
-				if (send_buff[1] == ID_FTSW)
-					ftsw_error_cnt = 0;
-				else if (send_buff[1] == ID_EXP)
-					exp_error_cnt = 0;
+				dprint("send failed at %d\n", c);
+
+				send_state = ssIdle;
+				push_event(evMsgFailed, static_cast<PedalDevice>(send_buff[1]), 0, Watch::now());
 
-				return true;
+				return;
 			}
+		}
 
-			byte_read = true;
+		send_started = Watch::now();
+		send_state = ssAwaitAck;
+	}
+	else if (send_state == ssAwaitAck  &&  Watch::ms_passed_since(ACK_TIMEOUT, send_started))
+	{
+		dprint("ack timeout\n");
+		message_done(false);
+	}
+}
 
-			dprint("bad checksum %02x\n", ack);
+void Pedals::message_done(const bool acked)
+{
+	send_state = ssIdle;
+	isr_await_reply = false;
 
-			break;
+	if (acked)
+	{
+		if (send_buff[1] == ID_FTSW)
+			ftsw_error_cnt = 0;
+		else if (send_buff[1] == ID_EXP)
+			exp_error_cnt = 0;
+
+		// the pedal is showing what we sent; the groups
+		// are in send_buff in the order of their bits
+		uint8_t idx = 2;
+		for (uint8_t g = 0; g < lgCount; g++)
+		{
+			if (send_groups & (1 << g))
+			{
+				leds_shown[g] = static_cast<uint8_t>(((send_buff[idx] & 1) << 7) | send_buff[idx + 1]);
+				leds_known |= 1 << g;
+				idx += 2;
+			}
 		}
+
+		push_event(evMsgAcked, static_cast<PedalDevice>(send_buff[1]), 0, Watch::now());
+
+		return;
 	}
 
-	if (!byte_read)
-		dprint("ack timeout\n");
+	push_event(evMsgFailed, static_cast<PedalDevice>(send_buff[1]), 0, Watch::now());
 
 	// check if we have too many errors and
 	// need to give up on a pedal
@@ -372,7 +1101,7 @@ bool Pedals::send_message()
 		if (++ftsw_error_cnt == MAX_ERROR_CNT)
 		{
 			clear_ftsw();
-			events.safe_push(evFtswOff);
+			push_event(evFtswOff, pdFtsw, 0, Watch::now());
 		}
 	}
 	else if (send_buff[1] == ID_EXP)
@@ -380,102 +1109,208 @@ bool Pedals::send_message()
 		if (++exp_error_cnt == MAX_ERROR_CNT)
 		{
 			clear_exp();
-			events.safe_push(evExpOff);
+			push_event(evExpOff, pdExp, 0, Watch::now());
 		}
 	}
+}
 
-	return false;
+// builds frames of the dirty LED groups which are not queued yet, up
+// to 3 groups of a pedal in a frame, and updates or drops the queued ones
+void Pedals::plan_frames()
+{
+	static_assert(sizeof(led_group_selectors) == lgCount);
+
+	// the groups in flight are refreshed again if they change until the ACK
+	const uint8_t in_flight = send_state != ssIdle ? send_groups : 0;
+
+	for (uint8_t g = 0; g < lgCount; g++)
+	{
+		const PedalDevice device = led_group_device(g);
+		if (device == pdFtsw ? !ftsw_present() : !exp_present())
+			continue;
+
+		// a queued group goes out with its latest value, or not
+		// at all if it's back to what the pedal shows; the governor
+		// doesn't hold this back, it only limits the new frames
+		if (leds_queued & (1 << g))
+		{
+			if (led_group_dirty(g))
+				update_group(g);
+			else
+				drop_group(g);
+
+			continue;
+		}
+
+		if (!led_group_dirty(g)  ||  (in_flight & (1 << g)))
+			continue;
+
+		// too soon for this output, so the group waits and
+		// goes out with whatever is the latest value by then
+		const PedalOutput output = led_group_output(g);
+		if (refresh_interval[output] != 0
+				&&  !Watch::ms_passed_since(refresh_interval[output], refresh_sent[output]))
+			continue;
+
+		// a frame has room for 3 groups of the same pedal
+		OutFrame* frame = find_frame(device);
+		if (frame == nullptr)
+		{
+			frame = alloc_frame(device);
+			if (frame == nullptr)
+				return;
+		}
+
+		put_group(*frame, g);
+	}
 }
 
-void Pedals::refresh_ftsw_leds()
+// the newest queued frame of the pedal if it has room for
+// another group, or nullptr
+Pedals::OutFrame* Pedals::find_frame(const PedalDevice device)
 {
-	if (new_ftsw_leds != ftsw_leds  &&  ftsw_present)
+	const ring_spans<uint8_t> queued = out_queue.peek_spans();
+
+	uint8_t slot;
+	if (queued.second.size != 0)
+		slot = queued.second.data[queued.second.size - 1];
+	else if (queued.first.size != 0)
+		slot = queued.first.data[queued.first.size - 1];
+	else
+		return nullptr;
+
+	// the frame is full if the last group is used
+	OutFrame& frame = out_pool[slot];
+	if (frame.data[1] != device  ||  frame.data[6] != 0)
+		return nullptr;
+
+	return &frame;
+}
+
+// returns nullptr if every frame is queued
+Pedals::OutFrame* Pedals::alloc_frame(const PedalDevice device)
+{
+	for (uint8_t slot = 0; slot < OUT_FRAMES; slot++)
 	{
-		// this message sets the individual LEDs on the foot switch
-		send_buff[0] = CMD_LED;
-		send_buff[1] = ID_FTSW;
-		send_buff[2] = LED_FTSW;
-		send_buff[3] = static_cast<uint8_t>(new_ftsw_leds & 0x7F);
-		send_buff[4] = 0;
-		send_buff[5] = 0;
-		send_buff[6] = 0;
-		send_buff[7] = 0;
+		if (out_free & (1 << slot))
+		{
+			out_free &= ~(1 << slot);
+			out_queue.push(slot);
 
-		if (new_ftsw_leds & 0x80)
-			send_buff[2] = LED_FTSW + 1;
+			// unused groups stay empty
+			OutFrame& frame = out_pool[slot];
+			memset(frame.data, 0, sizeof(frame.data));
+			frame.data[0] = CMD_LED;
+			frame.data[1] = device;
+			frame.groups = 0;
 
-		if (send_message())
-			ftsw_leds = new_ftsw_leds;
+			return &frame;
+		}
 	}
+
+	return nullptr;
 }
 
-void Pedals::refresh_exp_leds()
+// the groups are in the frame in the order of their bits,
+// so a new group can go in front of the ones in the frame
+uint8_t Pedals::group_offset(const OutFrame& frame, const uint8_t group)
 {
-	if (new_exp_leds != exp_leds  &&  exp_present)
+	uint8_t idx = 2;
+	for (uint8_t g = 0; g < group; g++)
 	{
-		// this message sets the individual LEDs on the foot switch
-		send_buff[0] = CMD_LED;
-		send_buff[1] = ID_EXP;
-		send_buff[2] = LED_EXP;
-		send_buff[3] = new_exp_leds;
-		send_buff[4] = 0;
-		send_buff[5] = 0;
-		send_buff[6] = 0;
-		send_buff[7] = 0;
+		if (frame.groups & (1 << g))
+			idx += 2;
+	}
 
-		if (send_message())
-			exp_leds = new_exp_leds;
+	return idx;
+}
+
+void Pedals::put_group(OutFrame& frame, const uint8_t group)
+{
+	const uint8_t idx = group_offset(frame, group);
+
+	// make room for a new group
+	if (!(frame.groups & (1 << group)))
+	{
+		for (uint8_t c = sizeof(frame.data) - 1; c >= idx + 2; c--)
+			frame.data[c] = frame.data[c - 2];
 	}
+
+	// the MSB of the value goes into the LSB of the selector
+	const uint8_t value = leds_wanted[group];
+	const uint8_t selector = pgm_read_byte(&led_group_selectors[group]);
+	frame.data[idx] = value & 0x80 ? selector + 1 : selector;
+	frame.data[idx + 1] = static_cast<uint8_t>(value & 0x7f);
+
+	frame.groups |= 1 << group;
+	leds_queued |= 1 << group;
 }
 
-void Pedals::refresh_ftsw_display()
+// the frame a queued group is in, or nullptr
+Pedals::OutFrame* Pedals::group_frame(const uint8_t group)
 {
-	if (new_ftsw_number != ftsw_number  &&  ftsw_present)
+	for (uint8_t slot = 0; slot < OUT_FRAMES; slot++)
 	{
-		// this message clears the LED display
-		send_buff[0] = CMD_LED;
-		send_buff[1] = ID_FTSW;
-		send_buff[2] = LED_DISP2;
-		send_buff[3] = 0;
-		send_buff[4] = LED_DISP1;
-		send_buff[5] = 0;
-		send_buff[6] = LED_DISP0;
-		send_buff[7] = 0;
+		if (!(out_free & (1 << slot))  &&  (out_pool[slot].groups & (1 << group)))
+			return &out_pool[slot];
+	}
 
-		// we modify the message in case we don't want
-		// to clear the display, but show a number instead
-		if (new_ftsw_number != FTSW_NUM_CLEAR)
-		{
-			uint8_t d0 = static_cast<uint8_t>(new_ftsw_number % 10);
-			uint8_t d2 = static_cast<uint8_t>(new_ftsw_number / 10);
-			uint8_t d1 = static_cast<uint8_t>(d2 % 10);
-			d2 /= 10;
+	return nullptr;
+}
 
-			uint8_t segments;
+// puts the latest value of a queued group into its frame
+void Pedals::update_group(const uint8_t group)
+{
+	OutFrame* frame = group_frame(group);
+	if (frame != nullptr)
+		put_group(*frame, group);
+}
 
-			if (SHOW_LEADING_ZEROS  ||  d2)
-			{
-				segments = pgm_read_byte(&digit_segments[d2]);
-				if (segments & 0x80)
-					send_buff[2] = LED_DISP2 + 1;
-				send_buff[3] = static_cast<uint8_t>(segments & 0x7f);
-			}
+// takes a queued group out of its frame; a frame left
+// empty stays queued, and is skipped when its turn comes
+void Pedals::drop_group(const uint8_t group)
+{
+	OutFrame* frame = group_frame(group);
+	if (frame == nullptr)
+		return;
 
-			if (SHOW_LEADING_ZEROS  ||  d1  ||  d2)
-			{
-				segments = pgm_read_byte(&digit_segments[d1]);
-				if (segments & 0x80)
-					send_buff[4] = LED_DISP1 + 1;
-				send_buff[5] = static_cast<uint8_t>(segments & 0x7f);
-			}
+	for (uint8_t c = group_offset(*frame, group); c < sizeof(frame->data) - 2; c++)
+		frame->data[c] = frame->data[c + 2];
 
-			segments = pgm_read_byte(&digit_segments[d0]);
-			if (segments & 0x80)
-				send_buff[6] = LED_DISP0 + 1;
-			send_buff[7] = static_cast<uint8_t>(segments & 0x7f);
+	frame->data[sizeof(frame->data) - 2] = 0;
+	frame->data[sizeof(frame->data) - 1] = 0;
+
+	frame->groups &= ~(1 << group);
+	leds_queued &= ~(1 << group);
+}
+
+// returns false if there is nothing to send
+bool Pedals::send_next_frame()
+{
+	uint8_t slot;
+	while (out_queue.safe_pop(slot))
+	{
+		const OutFrame& frame = out_pool[slot];
+
+		out_free |= 1 << slot;
+		leds_queued &= ~frame.groups;
+
+		// the pedal may be gone since, or the groups back to what it shows
+		if (frame.groups == 0  ||  (frame.data[1] == ID_FTSW ? !ftsw_present() : !exp_present()))
+			continue;
+
+		memcpy(send_buff, frame.data, sizeof(frame.data));
+		send_message(frame.groups);
+
+		const uint16_t now = Watch::now();
+		for (uint8_t g = 0; g < lgCount; g++)
+		{
+			if (frame.groups & (1 << g))
+				refresh_sent[led_group_output(g)] = now;
 		}
 
-		if (send_message())
-			ftsw_number = new_ftsw_number;
+		return true;
 	}
+
+	return false;
 }
@@ -3,8 +3,9 @@
 #include "usart.h"
 #include "iopin.h"
 #include "ring.h"
+#include "watch.h"
 
-enum PedalEvent : uint8_t
+enum PedalEventType : uint8_t
 {
 	evNone,
 
@@ -25,6 +26,101 @@ enum PedalEvent : uint8_t
 	evExpBtnUp,
 	evExpPosition,
 	evExpOff,
+
+	// the outcome of a message we sent to a pedal
+	evMsgAcked,
+	evMsgFailed,
+
+	evCount,
+};
+
+// the IDs of the pedals on the bus
+enum PedalDevice : uint8_t
+{
+	pdNone	= 0,
+	pdFtsw	= 0x08,
+	pdExp	= 0x0C,
+};
+
+struct PedalEvent
+{
+	PedalEventType	type;
+	PedalDevice		device;
+
+	// evExpPosition: the 14 bit position of the rocker
+	// button events: the buttons of the device which are down,
+	//		bit 0 for button 1 of the foot switch or the expression pedal
+	uint16_t		value;
+
+	// Watch::cnt() when the checksum byte of the message arrived,
+	// or when the event happened if it's not from a message
+	uint16_t		tick;
+};
+
+static_assert(evCount <= 32, "event masks are 32 bits");
+
+constexpr uint32_t event_mask(const PedalEventType type)
+{
+	return 1UL << type;
+}
+
+const uint32_t EVENTS_ALL = 0xffffffff;
+
+// one reader of the pedal events, like the display logic or a logger;
+// it gets the events in its mask from Pedals::get_event() at its own pace
+class EventSubscriber
+{
+	friend class Pedals;
+
+	uint32_t		mask = 0;
+	bcast_cursor	events_cur;
+	bcast_cursor	outcomes_cur;
+	uint16_t		position_seq = 0;
+	bool			holds_refresh = false;
+
+public:
+	// the number of events we lost because we fell too far behind
+	uint16_t lost_events() const
+	{
+		return events_cur.lost;
+	}
+
+	uint16_t lost_outcomes() const
+	{
+		return outcomes_cur.lost;
+	}
+};
+
+enum PedalStateFlags : uint8_t
+{
+	sfFtswPresent	= 0x01,
+	sfExpPresent	= 0x02,
+	sfExpBtn		= 0x04,		// the button of the expression pedal is down
+};
+
+// the last known state of the pedals
+struct PedalState
+{
+	// changes whenever anything below does
+	uint16_t	seq;
+
+	// the position of the rocker relative to the lowest one seen
+	uint16_t	exp_position;
+
+	// the buttons of the foot switch which are down, bit 0 for button 1
+	uint8_t		ftsw_buttons;
+
+	// PedalStateFlags
+	uint8_t		flags;
+
+	bool ftsw_present() const	{ return flags & sfFtswPresent; }
+	bool exp_present() const	{ return flags & sfExpPresent; }
+	bool exp_btn() const		{ return flags & sfExpBtn; }
+
+	bool ftsw_btn(const uint8_t num) const
+	{
+		return ftsw_buttons & (1 << (num - 1));
+	}
 };
 
 enum PedalLED : uint8_t
@@ -42,90 +138,374 @@ enum PedalLED : uint8_t
 	ledExpRed		= 13,
 };
 
-class Pedals: public Usart<3>
+// the things on the pedals we refresh with LED messages
+enum PedalOutput : uint8_t
+{
+	outFtswDisplay,
+	outFtswLeds,
+	outExpLeds,
+
+	outCount,
+};
+
+// the segments of a digit on the foot switch display
+enum PedalSegment : uint8_t
+{
+	segTopLeft		= 0x01,
+	segTop			= 0x02,
+	segTopRight		= 0x04,
+	segBottomLeft	= 0x08,
+	segBottomRight	= 0x10,
+	segDot			= 0x20,
+	segBottom		= 0x40,
+	segMiddle		= 0x80,		// sent in the LSB of the selector byte
+};
+
+// the RX buffer has to hold everything that arrives
+// while the main loop is busy with something else,
+// and the TX queue has room for a whole message and the ACK
+class Pedals: public Usart<3, 32, 16>
 {
 public:
 
-	bool		ftsw_present = false;
-	bool		exp_present = false;
+	// the time it takes us to ACK an incoming message in Watch ticks,
+	// from the checksum byte arriving until the ACK is sent
+	struct AckStats
+	{
+		uint16_t	cnt;
+		uint16_t	last;
+		uint16_t	max;
+	};
 
-	// last known states of buttons and rockers
-	bool		ftsw_btn1 = false;
-	bool		ftsw_btn2 = false;
-	bool		ftsw_btn3 = false;
-	bool		ftsw_btn4 = false;
-	uint16_t	exp_position = 0;
-	bool		exp_btn = false;
+	// the counters of an event queue; the times are in Watch ticks
+	struct QueueStats
+	{
+		uint16_t	pushes;
+		uint16_t	drops;		// events or positions overwritten before
+								// every subscriber has read them
+		uint16_t	peak;		// the most events a subscriber was behind;
+								// above the capacity of the queue means drops
+		uint16_t	dwell_last;	// from the capture of the event until get_event()
+		uint16_t	dwell_max;	// returned it, 0xffff if Watch::max_ms() or longer
+	};
 
-	uint8_t		exp_leds = 0;
-	uint16_t	ftsw_number = 0;
-	uint8_t		ftsw_leds = 0;
+	// number of messages dropped because they were cut off,
+	// or because of a bad checksum or a USART error
+	uint16_t	rx_timeouts = 0;
+	uint16_t	rx_bad_msgs = 0;
+
+	// number of our messages cut short because a pedal started talking
+	uint16_t	tx_preempted = 0;
+
+	// the button, init and offline events, the message
+	// outcomes, and the expression pedal positions
+	QueueStats	event_stats = {};
+	QueueStats	outcome_stats = {};
+	QueueStats	position_stats = {};
 
 	Pedals()
 	{
 		reset();
 	}
 
-	PedalEvent get_event();
+	// talks to the pedals; call it from the main loop as often as possible
+	void update();
+
+	// the subscriber gets the events in mask from now on; with
+	// holds_refresh the pedal LEDs are not refreshed while it has
+	// unread events in its mask, so the LED changes it makes for
+	// them go out together; returns false if there are too many subscribers
+	bool subscribe(EventSubscriber& sub, const uint32_t mask, const bool holds_refresh = false);
 
-	void set_ftsw_number(const uint16_t num)
+	// a consistent copy of the pedal state
+	PedalState snapshot() const;
+
+	// a cheap check if snapshot() would return something new
+	bool changed_since(const PedalState& snap) const
 	{
-		new_ftsw_number = num;
+		return state.seq != snap.seq;
+	}
 
-		// we can only show numbers from 0 to 999
-		// on a 3 digit LED display
-		while (new_ftsw_number > 999)
-			new_ftsw_number -= 1000;
+	bool ftsw_present() const
+	{
+		return state.ftsw_present();
 	}
 
-	void clear_ftsw_number()
+	bool exp_present() const
 	{
-		new_ftsw_number = FTSW_NUM_CLEAR;
+		return state.exp_present();
+	}
+
+	// returns the next event of the subscriber, or evNone
+	PedalEvent get_event(EventSubscriber& sub);
+
+	void set_ftsw_number(uint16_t num);
+	void clear_ftsw_number();
+
+	// the raw foot switch display: digit 0 is the left one, and
+	// segments are PedalSegment bits; only the digits which
+	// changed are sent to the pedal
+	void set_ftsw_digit(const uint8_t digit, const uint8_t segments);
+	uint8_t get_ftsw_digit(const uint8_t digit) const;
+
+	// the digits the pedal is not showing yet, bit 0 for digit 0
+	uint8_t ftsw_dirty_digits() const;
+
+	// an output is refreshed at most once in this many milliseconds
+	// (0 is as fast as the bus goes); changes in between are not lost,
+	// the output shows the latest one when its time comes; the interval
+	// is clamped to Watch::max_ms(), the longest the Watch can measure
+	void set_refresh_interval(const PedalOutput output, const uint16_t ms)
+	{
+		refresh_interval[output] = ms < Watch::max_ms() ? ms : Watch::max_ms();
 	}
 
 	void set_led(const PedalLED led);
 	void clear_led(const PedalLED led);
 
+	// starts a power cycle of the pedals, update()
+	// finishes it without blocking the caller
 	void reset();
 	void clear();
 	void clear_ftsw();
 	void clear_exp();
 
+	static AckStats get_ack_stats();
+
+	// these have to be called from the USART3 interrupts
+	static void rx_isr();
+	static void tx_isr();
+
 private:
 
 	enum {
-		FTSW_NUM_UNKNOWN	= 0xfffe,
-		FTSW_NUM_CLEAR		= 0xffff,
+		MAX_SUBSCRIBERS		= 4,
+		OUT_FRAMES			= 4,	// the LED messages we can have queued
+
+		// the default minimum milliseconds between two refreshes of the
+		// foot switch display, so a moving rocker which changes the number
+		// all the time doesn't crowd the pedals' messages off the bus
+		DISPLAY_REFRESH_INTERVAL = 40,
 	};
 
+	enum SendState : uint8_t
+	{
+		ssIdle,
+		ssSending,		// the message is going out on the bus
+		ssAwaitAck,		// the pedal has to ACK it
+	};
+
+	enum PowerState : uint8_t
+	{
+		psOff,			// the pedals are being power cycled
+		psWaitInit,		// the pedals are booting
+		psOn,
+	};
+
+	// the selector/value groups of the LED messages; a message has
+	// room for 3 groups of a pedal, and we send the dirty ones in this order
+	enum LedGroup : uint8_t
+	{
+		lgFtswDisp2,	// the left digit
+		lgFtswDisp1,
+		lgFtswDisp0,
+		lgFtswLeds,
+		lgExpLeds,
+
+		lgCount,
+	};
+
+	enum : uint8_t
+	{
+		FTSW_GROUPS	= (1 << lgFtswDisp2) | (1 << lgFtswDisp1) | (1 << lgFtswDisp0) | (1 << lgFtswLeds),
+		EXP_GROUPS	= 1 << lgExpLeds,
+	};
+
+	static PedalDevice led_group_device(const uint8_t group)
+	{
+		return (EXP_GROUPS & (1 << group)) ? pdExp : pdFtsw;
+	}
+
+	static PedalOutput led_group_output(const uint8_t group)
+	{
+		if (group == lgFtswLeds)
+			return outFtswLeds;
+		if (group == lgExpLeds)
+			return outExpLeds;
+
+		return outFtswDisplay;
+	}
+
+	bool led_group_dirty(const uint8_t group) const
+	{
+		return !(leds_known & (1 << group))  ||  leds_shown[group] != leds_wanted[group];
+	}
+
 	uint8_t		received = 0;
 	uint8_t		receive[7];
 	uint8_t		expected = 0;
+	bool		rx_bad = false;		// a byte of the message had a USART error
 
 	uint16_t	min_pos = 0xffff;
 	uint16_t	max_pos = 0;
 
-	uint16_t	new_ftsw_number = FTSW_NUM_CLEAR;
-	uint8_t		new_ftsw_leds	= 0;
-	uint8_t		new_exp_leds	= 0;
+	// what we want the LED groups to show, and what the pedals show
+	// since they ACK-ed our message; a group is dirty if these differ,
+	// or if its bit in leds_known is cleared because the pedal was reset
+	uint8_t		leds_wanted[lgCount]	= {};
+	uint8_t		leds_shown[lgCount]		= {};
+	uint8_t		leds_known		= 0;
+
+	// the refresh rate governor: the minimum milliseconds between two
+	// messages to an output, and when the last one was sent
+	uint16_t	refresh_interval[outCount]	= { DISPLAY_REFRESH_INTERVAL, 0, 0 };
+	uint16_t	refresh_sent[outCount]	= {};
 
 	uint16_t	last_reception	= 0;
 
+	PowerState	power_state		= psOff;
+	uint16_t	power_started	= 0;
+	uint16_t	power_off_time	= 0;
+	uint16_t	power_off_good	= 0;	// the shortest that worked, 0 until one has
+	uint16_t	power_off_bad	= 0;	// the longest that didn't
+
+	PedalState	state			= {};
+
 	uint8_t		ftsw_error_cnt	= 0;
 	uint8_t		exp_error_cnt	= 0;
 
-	ring<PedalEvent, 10>	events;
+	// the Watch wraps around every Watch::max_ms(), so we count
+	// its laps to tell how long an event has waited to be read
+	uint16_t	watch_laps		= 0;
+	uint16_t	watch_last		= 0;
+
+	// an event, and the lap of the Watch its tick is in
+	struct QueuedEvent
+	{
+		PedalEvent	event;
+		uint16_t	lap;
+	};
+
+	// every event is stored once, and the subscribers read them
+	// with their own cursors; get_event() serves these in order, so
+	// a button press never waits behind a moving expression pedal:
+	// the button, init and offline edges of the pedals
+	bcast_ring<QueuedEvent, 16>	events;
+	// the outcomes of the messages we sent
+	bcast_ring<QueuedEvent, 4>	outcomes;
+	// the latest expression pedal position, updated in place because
+	// only the latest one matters; position_seq counts the updates
+	QueuedEvent	pending_pos		= {};
+	uint16_t	position_seq	= 0;
+	uint16_t	pos_unread		= 0;	// positions since the slowest subscriber read one
+
+	EventSubscriber*	subscribers[MAX_SUBSCRIBERS];
+	uint8_t				subscriber_cnt	= 0;
+
+	// the RX interrupt follows the incoming messages on its own,
+	// so it can ACK them as soon as the checksum byte arrives
+	inline static uint8_t	isr_received	= 0;
+	inline static uint8_t	isr_expected	= 0;
+	inline static uint8_t	isr_checksum	= 0;
+	inline static bool		isr_bad			= false;
+	inline static uint16_t	isr_last_rx		= 0;
+
+	// when the checksum bytes arrived, one for every byte
+	// tagged with rxTag; a message is at least 4 bytes, so
+	// 8 ticks are enough for the whole RX buffer
+	inline static spsc_ring<uint16_t, 8>	isr_msg_ticks;
+	uint16_t	msg_tick = 0;
+
+	// the echo of the message we are sending, which we
+	// compare to send_buff once the message is out
+	inline static uint8_t			isr_echo[9];
+	inline static volatile uint8_t	isr_echo_len	= 0;
+	inline static uint8_t			isr_echo_cap	= 0;
+	inline static uint8_t			isr_echo_skip	= 0;	// echoes of bytes sent before the message
+
+	// the RX interrupt has stopped our message for a pedal's
+	inline static volatile bool		isr_tx_aborted	= false;
+
+	// the message being sent, and after it was stopped, the bytes
+	// still in the USART whose echo is yet to come back, and where
+	// they are in the message
+	inline static const uint8_t*	isr_sent		= nullptr;
+	inline static uint8_t			isr_abort_left	= 0;
+	inline static uint8_t			isr_abort_pos	= 0;
+
+	// the whole message is back from the bus as we sent it, so the next
+	// ACK or ERROR byte is the pedal's reply, which the RX interrupt tags
+	// with rxTag2; it's cleared once the reply is in or has timed out
+	inline static volatile bool		isr_await_reply	= false;
+
+	// flips with every message we send, and the reply is tagged with
+	// rxTag4 if it's set, so a late reply to a message that has timed
+	// out is not taken for the reply to the next one
+	inline static bool				isr_send_gen	= false;
+
+	inline static bool		ack_queued		= false;
+	inline static uint16_t	ack_since		= 0;
+	inline static AckStats	ack_stats		= {};
+
+	// the message we send, the last byte is the checksum
+	uint8_t		send_buff[9];
+
+	SendState	send_state		= ssIdle;
+	uint8_t		send_groups		= 0;	// the LedGroup bits in send_buff
+
+	// an LED message waiting for its turn on the bus
+	struct OutFrame
+	{
+		uint8_t		data[8];	// the checksum is added when it's sent
+		uint8_t		groups;		// the LedGroup bits in data
+	};
+
+	// the frames are built in out_pool, and their indices are queued in
+	// out_queue; a dirty group is in at most one frame (leds_queued),
+	// which is updated in place if the group changes again
+	OutFrame		out_pool[OUT_FRAMES];
+	ring<uint8_t, OUT_FRAMES + 1>	out_queue;
+	uint8_t			out_free		= (1 << OUT_FRAMES) - 1;	// the free slots of out_pool
+	uint8_t			leds_queued		= 0;
+	uint16_t	send_started	= 0;
+
+	static uint8_t message_length(const uint8_t cmd);
+
+	static uint16_t last_rx();
+
+	void power_off();
+	void power_on();
+
+	bool events_pending() const;
+
+	uint16_t watch_lap(const uint16_t tick);
+
+	template <uint8_t Capacity>
+	void count_push(QueueStats& stats, const bcast_ring<QueuedEvent, Capacity>& queue,
+					bcast_cursor EventSubscriber::* cur);
+
+	template <uint8_t Capacity>
+	bool read_queue(QueueStats& stats, const bcast_ring<QueuedEvent, Capacity>& queue,
+					bcast_cursor& cur, const uint32_t mask, PedalEvent& event);
 
-	uint8_t		send_buff[8];
+	void count_dwell(QueueStats& stats, const QueuedEvent& queued);
 
-	bool consume(const uint8_t byte);
-	void update_button_state(const PedalEvent event);
-	bool send_message();
+	bool consume(const uint8_t byte, const uint8_t errors);
+	void update_button_state(const PedalEventType type);
+	void push_event(const PedalEventType type, const PedalDevice device, const uint16_t value, const uint16_t tick);
 	void parse_message();
 
-	bool send(const uint8_t b);
+	void send_message(const uint8_t groups);
+	void advance_message();
+	void message_done(const bool acked);
 
-	void refresh_ftsw_display();
-	void refresh_ftsw_leds();
-	void refresh_exp_leds();
+	void plan_frames();
+	OutFrame* find_frame(const PedalDevice device);
+	OutFrame* alloc_frame(const PedalDevice device);
+	static uint8_t group_offset(const OutFrame& frame, const uint8_t group);
+	void put_group(OutFrame& frame, const uint8_t group);
+	OutFrame* group_frame(const uint8_t group);
+	void update_group(const uint8_t group);
+	void drop_group(const uint8_t group);
+	bool send_next_frame();
 };
@@ -1,5 +1,39 @@
 #pragma once
 
+#include <avr/cpufunc.h>
+
+// a contiguous piece of a ring buffer's store
+template <class T>
+struct ring_span
+{
+    T*      data;
+    uint8_t size;
+};
+
+// a piece of a ring buffer can wrap around the end
+// of the store, so it takes at most two spans
+template <class T>
+struct ring_spans
+{
+    ring_span<T>    first;
+    ring_span<T>    second;
+
+    uint8_t size() const
+    {
+        return static_cast<uint8_t>(first.size + second.size);
+    }
+};
+
+// splits cnt elements starting at idx into spans
+template <class T>
+ring_spans<T> make_ring_spans(T* store, const uint8_t capacity, const uint8_t idx, const uint8_t cnt)
+{
+    const uint8_t to_end = static_cast<uint8_t>(capacity - idx);
+    const uint8_t first = cnt < to_end ? cnt : to_end;
+
+    return { { store + idx, first }, { store, static_cast<uint8_t>(cnt - first) } };
+}
+
 // simple ring buffer for POD types
 template <class T, uint8_t Capacity>
 class ring
@@ -11,6 +45,13 @@ private:
     uint8_t head = 0;
     uint8_t tail = 0;
 
+    // wrap around without a division, Capacity
+    // doesn't have to be a power of 2
+    static uint8_t next(const uint8_t idx)
+    {
+        return idx + 1 == Capacity ? 0 : static_cast<uint8_t>(idx + 1);
+    }
+
 public:
 
     uint8_t capacity() const
@@ -29,7 +70,7 @@ public:
     void push(T c)
     {
         store[head] = c;
-        head = static_cast<uint8_t>((head + 1) % Capacity);
+        head = next(head);
     }
 
     bool safe_push(T c)
@@ -44,7 +85,7 @@ public:
     T pop()
     {
         T ret_val = store[tail];
-        tail = static_cast<uint8_t>((tail + 1) % Capacity);
+        tail = next(tail);
 
         return ret_val;
     }
@@ -65,7 +106,143 @@ public:
 
     bool full() const
     {
-        return ((head + 1) % Capacity) == tail;
+        return next(head) == tail;
+    }
+
+    bool empty() const
+    {
+        return head == tail;
+    }
+
+    void clear()
+    {
+        head = tail = 0;
+    }
+
+    // bulk access: fill the free room returned by reserve(), then
+    // commit() the number of elements written; or use the elements
+    // returned by peek_spans(), then consume() the number used
+    ring_spans<T> reserve()
+    {
+        return make_ring_spans(store, Capacity, head, static_cast<uint8_t>(capacity() - size()));
+    }
+
+    // the sums can be above 255 if Capacity is above 128
+    void commit(const uint8_t cnt)
+    {
+        const uint16_t h = head + cnt;
+        head = static_cast<uint8_t>(h >= Capacity ? h - Capacity : h);
+    }
+
+    ring_spans<T> peek_spans()
+    {
+        return make_ring_spans(store, Capacity, tail, size());
+    }
+
+    void consume(const uint8_t cnt)
+    {
+        const uint16_t t = tail + cnt;
+        tail = static_cast<uint8_t>(t >= Capacity ? t - Capacity : t);
+    }
+};
+
+// lock-free ring buffer for POD types with a single producer and a
+// single consumer, one of which can be an interrupt; the indices are
+// free running bytes, so all of Capacity is usable, and are masked
+// into the store, so Capacity has to be a power of 2
+template <class T, uint8_t Capacity>
+class spsc_ring
+{
+private:
+    static_assert(Capacity != 0  &&  Capacity <= 0x80  &&  (Capacity & (Capacity - 1)) == 0,
+                    "spsc_ring capacity has to be a power of 2");
+
+    static constexpr uint8_t MASK = Capacity - 1;
+
+    T store[Capacity];
+
+    // a byte is read and written atomically, and only the
+    // producer writes head and only the consumer writes tail
+    volatile uint8_t head = 0;
+    volatile uint8_t tail = 0;
+
+public:
+
+    uint8_t capacity() const
+    {
+        return Capacity;
+    }
+
+    uint8_t size() const
+    {
+        return static_cast<uint8_t>(head - tail);
+    }
+
+    // producer side
+
+    void push(T c)
+    {
+        const uint8_t h = head;
+        store[h & MASK] = c;
+
+        // the element has to be in the store before the consumer sees it
+        _MemoryBarrier();
+        head = static_cast<uint8_t>(h + 1);
+    }
+
+    bool safe_push(T c)
+    {
+        if (full())
+            return false;
+
+        push(c);
+        return true;
+    }
+
+    bool full() const
+    {
+        return size() == Capacity;
+    }
+
+    // fill the returned free room, then commit() what was written
+    ring_spans<T> reserve()
+    {
+        return make_ring_spans(store, Capacity, static_cast<uint8_t>(head & MASK),
+                                static_cast<uint8_t>(Capacity - size()));
+    }
+
+    void commit(const uint8_t cnt)
+    {
+        _MemoryBarrier();
+        head = static_cast<uint8_t>(head + cnt);
+    }
+
+    // consumer side
+
+    T pop()
+    {
+        const uint8_t t = tail;
+        T ret_val = store[t & MASK];
+
+        // the element has to be out of the store before the producer reuses it
+        _MemoryBarrier();
+        tail = static_cast<uint8_t>(t + 1);
+
+        return ret_val;
+    }
+
+    bool safe_pop(T& c)
+    {
+        if (empty())
+            return false;
+
+        c = pop();
+        return true;
+    }
+
+    T peek() const
+    {
+        return store[tail & MASK];
     }
 
     bool empty() const
@@ -73,8 +250,113 @@ public:
         return head == tail;
     }
 
+    // use the returned elements, then consume() what was used
+    ring_spans<T> peek_spans()
+    {
+        return make_ring_spans(store, Capacity, static_cast<uint8_t>(tail & MASK), size());
+    }
+
+    void consume(const uint8_t cnt)
+    {
+        _MemoryBarrier();
+        tail = static_cast<uint8_t>(tail + cnt);
+    }
+
+    // only when neither side is active
     void clear()
     {
         head = tail = 0;
     }
 };
+
+// where a reader of a bcast_ring is, and how many
+// elements it lost because it fell too far behind
+struct bcast_cursor
+{
+    uint16_t    pos = 0;
+    uint16_t    lost = 0;
+};
+
+// ring buffer for POD types with any number of readers; every element
+// is stored once, and every reader gets all of them through its own
+// bcast_cursor. The writer never waits for the readers, so a reader
+// which is more than Capacity elements behind loses the oldest ones.
+// Capacity has to be a power of 2.
+template <class T, uint8_t Capacity>
+class bcast_ring
+{
+private:
+    static_assert(Capacity != 0  &&  Capacity <= 0x80  &&  (Capacity & (Capacity - 1)) == 0,
+                    "bcast_ring capacity has to be a power of 2");
+
+    static constexpr uint8_t MASK = Capacity - 1;
+
+    T store[Capacity];
+
+    // the number of elements ever pushed
+    uint16_t head = 0;
+
+public:
+
+    void push(T c)
+    {
+        store[head & MASK] = c;
+        head++;
+    }
+
+    // the reader starts with the next pushed element
+    void join(bcast_cursor& cur) const
+    {
+        cur.pos = head;
+    }
+
+    bool pending(const bcast_cursor& cur) const
+    {
+        return cur.pos != head;
+    }
+
+    // true if pred(element) is true for an element the reader has not read yet
+    template <class Pred>
+    bool pending(const bcast_cursor& cur, Pred&& pred) const
+    {
+        // the overwritten ones don't count
+        uint16_t pos = cur.pos;
+        if (static_cast<uint16_t>(head - pos) > Capacity)
+            pos = head - Capacity;
+
+        for (; pos != head; pos++)
+        {
+            if (pred(store[pos & MASK]))
+                return true;
+        }
+
+        return false;
+    }
+
+    // the number of elements the reader has not read yet,
+    // including the ones it will lose if it's more than Capacity
+    uint16_t behind(const bcast_cursor& cur) const
+    {
+        return head - cur.pos;
+    }
+
+    // returns false if the reader has seen every element
+    bool read(bcast_cursor& cur, T& c) const
+    {
+        if (cur.pos == head)
+            return false;
+
+        // skip what was overwritten
+        const uint16_t behind = head - cur.pos;
+        if (behind > Capacity)
+        {
+            cur.lost += behind - Capacity;
+            cur.pos = head - Capacity;
+        }
+
+        c = store[cur.pos & MASK];
+        cur.pos++;
+
+        return true;
+    }
+};
@@ -1,6 +1,28 @@
 #pragma once
 
-template <uint8_t UsartNum>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "ring.h"
+
+// RxBuffSize == 0 means we poll the receiver with read_byte().
+// Otherwise the RXC interrupt moves received bytes into a ring buffer,
+// and the USARTn_RXC_vect ISR of the user must call rx_isr().
+//
+// TxBuffSize == 0 means send_byte() waits for the data register.
+// Otherwise send_byte() queues the byte and returns, and the
+// USARTn_DRE_vect ISR of the user must call tx_isr().
+// Global interrupts have to be enabled before anything is sent.
+//
+// Every received byte comes with the error flags from RXDATAH
+// (parity, frame and buffer overflow), and we count the errors.
+//
+// On a half-duplex bus we receive everything we send. In that case
+// set_half_duplex() makes rx_isr() discard one received byte for
+// every byte we have sent, so the user never sees the echo.
+template <uint8_t UsartNum, uint8_t RxBuffSize = 0, uint8_t TxBuffSize = 0>
 class Usart
 {
 protected:
@@ -11,6 +33,65 @@ protected:
 		return (&USART0)[UsartNum * 2];
 	}
 
+	// only instantiated if the interrupt modes are used (size 1
+	// just keeps the type valid when a mode is not used);
+	// RX keeps the error flags in the high byte like RXDATAH.
+	// The RX interrupt is the only producer of rx_buff, and the
+	// DRE interrupt is the only consumer of tx_buff. The TX producers
+	// lock out the interrupts because the RXC interrupt of the
+	// user can queue bytes too (like an ACK).
+	inline static spsc_ring<uint16_t, RxBuffSize ? RxBuffSize : 1> rx_buff;
+	inline static spsc_ring<uint8_t, TxBuffSize ? TxBuffSize : 1> tx_buff;
+
+	// the number of sent bytes whose echo we have not received yet
+	inline static volatile uint8_t echo_pending = 0;
+	inline static bool half_duplex = false;
+
+public:
+	// the error flags of a received byte
+	enum : uint8_t
+	{
+		errParity	= USART_PERR_bm,
+		errFrame	= USART_FERR_bm,
+		errOverflow	= USART_BUFOVF_bm,	// the hardware lost a byte before this one
+
+		errAll		= errParity | errFrame | errOverflow,
+
+		// not errors; the RX interrupt of the user can
+		// tag a byte with them when calling rx_store()
+		rxTag		= 0x80,
+		rxTag2		= 0x01,
+		rxTag3		= 0x08,
+		rxTag4		= 0x10,
+	};
+
+	struct ErrorCounts
+	{
+		uint16_t	parity;
+		uint16_t	frame;
+		uint16_t	overflow;
+		uint16_t	dropped;		// the RX buffer was full
+	};
+
+protected:
+	inline static ErrorCounts error_cnts = {};
+
+	static uint8_t read_rxdata(uint8_t& b)
+	{
+		// RXDATAH has to be read first
+		const uint8_t errors = get_usart().RXDATAH & errAll;
+		b = get_usart().RXDATAL;
+
+		if (errors & errParity)
+			error_cnts.parity++;
+		if (errors & errFrame)
+			error_cnts.frame++;
+		if (errors & errOverflow)
+			error_cnts.overflow++;
+
+		return errors;
+	}
+
 public:
 	static void set_baud(const uint32_t baud)
 	{
@@ -21,24 +102,267 @@ public:
 
 	static void enable(const bool tx, const bool rx)
 	{
-		get_usart().CTRLB = static_cast<uint8_t>( (rx ? USART_RXEN_bm : 0)
+		if constexpr (RxBuffSize != 0)
+		{
+			if (rx)
+			{
+				ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+					rx_buff.clear();
+
+				get_usart().CTRLA |= USART_RXCIE_bm;
+			}
+			else
+			{
+				get_usart().CTRLA &= ~USART_RXCIE_bm;
+			}
+		}
+
+		if constexpr (TxBuffSize != 0)
+		{
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				tx_buff.clear();
+				get_usart().CTRLA &= ~USART_DREIE_bm;
+			}
+		}
+
+		echo_pending = 0;
+
+		get_usart().CTRLB = static_cast<uint8_t>( (get_usart().CTRLB & ~(USART_RXEN_bm | USART_TXEN_bm))
+												| (rx ? USART_RXEN_bm : 0)
 												| (tx ? USART_TXEN_bm : 0) );
 	}
 
+	// one_wire uses the loop-back and open-drain modes, so TX and RX
+	// share the TX pin, and the bus needs nothing but a pull-up
+	static void set_half_duplex(const bool one_wire)
+	{
+		static_assert(RxBuffSize != 0, "echo is discarded in the RX interrupt");
+
+		half_duplex = true;
+
+		if (one_wire)
+		{
+			get_usart().CTRLA |= USART_LBME_bm;
+			get_usart().CTRLB |= USART_ODME_bm;
+		}
+		else
+		{
+			get_usart().CTRLA &= ~USART_LBME_bm;
+			get_usart().CTRLB &= ~USART_ODME_bm;
+		}
+	}
+
+	// true while there are sent bytes which are not back
+	// on the bus yet; only makes sense on a half-duplex bus
+	static bool tx_busy()
+	{
+		bool ret_val;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if constexpr (TxBuffSize != 0)
+				ret_val = echo_pending != 0  ||  !tx_buff.empty();
+			else
+				ret_val = echo_pending != 0;
+		}
+
+		return ret_val;
+	}
+
+	// forget about the echo we are still waiting for
+	// in case it never came back
+	static void flush_echo()
+	{
+		echo_pending = 0;
+	}
+
 	static void send_byte(const uint8_t b)
 	{
-		loop_until_bit_is_set(get_usart().STATUS, USART_DREIF_bp);
-		get_usart().TXDATAL = b;
+		if constexpr (TxBuffSize != 0)
+		{
+			// wait for room in the queue
+			while (tx_free() == 0)
+				;
+
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				tx_buff.push(b);
+				get_usart().CTRLA |= USART_DREIE_bm;
+			}
+		}
+		else
+		{
+			loop_until_bit_is_set(get_usart().STATUS, USART_DREIF_bp);
+
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				get_usart().TXDATAL = b;
+				if (half_duplex)
+					echo_pending = echo_pending + 1;
+			}
+		}
+	}
+
+	// queues the whole buffer and returns at once,
+	// or returns false if there is not enough room for it
+	static bool send(const uint8_t* buff, const uint8_t len)
+	{
+		static_assert(TxBuffSize != 0, "send() needs the TX queue");
+
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			const ring_spans<uint8_t> room = tx_buff.reserve();
+			if (room.size() < len)
+				return false;
+
+			// copy into the free room, and publish it all at once
+			const uint8_t first = len < room.first.size ? len : room.first.size;
+			memcpy(room.first.data, buff, first);
+			memcpy(room.second.data, buff + first, len - first);
+
+			tx_buff.commit(len);
+
+			get_usart().CTRLA |= USART_DREIE_bm;
+		}
+
+		return true;
+	}
+
+	// drops the bytes which are still in the TX queue; the ones
+	// already given to the USART go out, and their echo is discarded.
+	// Only from the interrupts, or with the interrupts disabled.
+	static void abort_tx()
+	{
+		static_assert(TxBuffSize != 0, "abort_tx() needs the TX queue");
+
+		tx_buff.clear();
+		get_usart().CTRLA &= ~USART_DREIE_bm;
+	}
+
+	// the number of bytes we can queue without waiting
+	static uint8_t tx_free()
+	{
+		return static_cast<uint8_t>(tx_buff.capacity() - tx_buff.size());
+	}
+
+	static bool read_byte(uint8_t& b, uint8_t& errors)
+	{
+		if constexpr (RxBuffSize != 0)
+		{
+			uint16_t data;
+			const bool ret_val = rx_buff.safe_pop(data);
+
+			b = static_cast<uint8_t>(data);
+			errors = static_cast<uint8_t>(data >> 8);
+
+			return ret_val;
+		}
+		else
+		{
+			if (get_usart().STATUS & USART_RXCIF_bm)
+			{
+				errors = read_rxdata(b);
+				return true;
+			}
+
+			return false;
+		}
 	}
 
 	static bool read_byte(uint8_t& b)
 	{
-		if (get_usart().STATUS & USART_RXCIF_bm)
+		uint8_t errors;
+		return read_byte(b, errors);
+	}
+
+	// calls handler(byte, errors) for every byte in the RX buffer,
+	// and then frees them in one go; returns the number of bytes
+	template <class Handler>
+	static uint8_t read_all(Handler&& handler)
+	{
+		static_assert(RxBuffSize != 0, "read_all() needs the RX buffer");
+
+		const ring_spans<uint16_t> data = rx_buff.peek_spans();
+
+		for (uint8_t c = 0; c < data.first.size; c++)
+			handler(static_cast<uint8_t>(data.first.data[c]), static_cast<uint8_t>(data.first.data[c] >> 8));
+
+		for (uint8_t c = 0; c < data.second.size; c++)
+			handler(static_cast<uint8_t>(data.second.data[c]), static_cast<uint8_t>(data.second.data[c] >> 8));
+
+		rx_buff.consume(data.size());
+
+		return data.size();
+	}
+
+	static ErrorCounts get_error_counts()
+	{
+		ErrorCounts ret_val;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			ret_val = error_cnts;
+
+		return ret_val;
+	}
+
+	// the two halves of rx_isr() for a user RXC interrupt which
+	// wants to look at the byte before it goes into the RX buffer;
+	// rx_read() returns false if b is the echo of a byte we sent,
+	// otherwise b has to be passed on to rx_store()
+	static bool rx_read(uint8_t& b, uint8_t& errors)
+	{
+		// reading RXDATAL clears the interrupt flag, so we have to
+		// read it even if the buffer is full and we drop the byte
+		errors = read_rxdata(b);
+
+		if (echo_pending)
 		{
-			b = get_usart().RXDATAL;
-			return true;
+			echo_pending = echo_pending - 1;
+			return false;
 		}
-		
+
+		return true;
+	}
+
+	// returns false if the RX buffer was full
+	static bool rx_store(const uint8_t b, const uint8_t flags)
+	{
+		if (rx_buff.safe_push(static_cast<uint16_t>((flags << 8) | b)))
+			return true;
+
+		error_cnts.dropped++;
+
 		return false;
 	}
+
+	// call this from the RXC interrupt in interrupt mode;
+	// returns false if b is the echo of a byte we sent, otherwise
+	// b is the received byte which was put into the RX buffer
+	static bool rx_isr(uint8_t& b, uint8_t& errors)
+	{
+		if (!rx_read(b, errors))
+			return false;
+
+		rx_store(b, errors);
+
+		return true;
+	}
+
+	static void rx_isr()
+	{
+		uint8_t b, errors;
+		rx_isr(b, errors);
+	}
+
+	// call this from the DRE interrupt in interrupt mode
+	static void tx_isr()
+	{
+		get_usart().TXDATAL = tx_buff.pop();
+
+		if (half_duplex)
+			echo_pending = echo_pending + 1;
+
+		// nothing more to send, so we silence the interrupt
+		if (tx_buff.empty())
+			get_usart().CTRLA &= ~USART_DREIE_bm;
+	}
 };
@@ -0,0 +1,7 @@
+#pragma once
+
+#define _VECTOR(N)		__vector_ ## N
+#define ISR(vector)		void vector()
+
+void sei();
+void cli();
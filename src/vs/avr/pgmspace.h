@@ -2,4 +2,5 @@
 
 #define PROGMEM
 
-#define pgm_read_byte(a)	*(a)
\ No newline at end of file
+#define pgm_read_byte(a)	*(a)
+#define pgm_read_ptr(a)	(*(void* const*)(a))
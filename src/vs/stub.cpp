@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 
 uint8_t		CPU_CCP;
@@ -20,3 +21,11 @@ void loop_until_bit_is_set(const uint16_t byte, const uint8_t bit)
 	(void)byte;
 	(void)bit;
 }
+
+void sei()
+{
+}
+
+void cli()
+{
+}
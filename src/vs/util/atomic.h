@@ -0,0 +1,5 @@
+#pragma once
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type)
@@ -1,22 +1,42 @@
 #pragma once
 
+#include <util/atomic.h>
+
 #include "timera.h"
 
 class Watch : public TimerA<1, TimerA_Prescale::div1024>
 {
 public:
-	static uint32_t ticks2ms(const uint32_t ticks)
+	constexpr static uint32_t ticks2ms(const uint32_t ticks)
 	{
 		return ticks * get_div() / (F_CPU / 1000);
 	}
 
-	static uint32_t ms2ticks(const uint32_t ms)
+	constexpr static uint32_t ms2ticks(const uint32_t ms)
 	{
 		return ms * (F_CPU / 1000) / get_div();
 	}
 
+	// interrupts read the counter too, and 16 bit reads share the
+	// TEMP register, so outside of interrupts we read it atomically
+	static uint16_t now()
+	{
+		uint16_t ret_val;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			ret_val = cnt();
+
+		return ret_val;
+	}
+
+	// the longest time ms_passed_since() can measure, because
+	// the counter is 16 bits; about 2.8 seconds at 24MHz
+	constexpr static uint16_t max_ms()
+	{
+		return static_cast<uint16_t>(ticks2ms(0xffff));
+	}
+
 	static bool ms_passed_since(const uint16_t ms, const uint16_t since)
 	{
-		return static_cast<uint32_t>(cnt() - since) >= ms2ticks(ms);
+		return static_cast<uint16_t>(now() - since) >= ms2ticks(ms);
 	}
 };